@@ -0,0 +1,35 @@
+#!/bin/bash
+# Measure compile time and code size of a translation unit with many distinct
+# then()/fail() call sites.
+#
+#   bench/bloat.sh [number of call sites] [extra compiler flags...]
+
+n="${1:-1000}"
+shift
+cxx="${CXX:-c++}"
+dir="$(cd "$(dirname "$0")/.." && pwd)"
+tmp="$(mktemp -d)"
+trap 'rm -rf "$tmp"' EXIT
+
+{
+    echo '#include "promise.hpp"'
+    echo 'using promise::promise_t;'
+    echo 'int sink;'
+    for ((i = 0; i < n; i++)); do
+        echo "void site$i(const promise_t &pm) {"
+        case $((i % 4)) in
+            0) echo "    pm.then([](int x) { return x + $i; });" ;;
+            1) echo "    pm.then([](int x) { sink += x + $i; }, [](int e) { sink -= e + $i; });" ;;
+            2) echo "    pm.then([](int x) { return promise::resolved(x * $i); });" ;;
+            3) echo "    pm.fail([](int e) { sink ^= e + $i; });" ;;
+        esac
+        echo "}"
+    done
+} > "$tmp/bloat.cpp"
+
+start=$(date +%s%N)
+"$cxx" -std=c++17 -O2 -c -I"$dir" "$@" -o "$tmp/bloat.o" "$tmp/bloat.cpp" || exit 1
+end=$(date +%s%N)
+printf "call sites:   %d\n" "$n"
+printf "compile time: %d ms\n" $(((end - start) / 1000000))
+size "$tmp/bloat.o" | awk 'NR == 2 {printf "text size:    %d bytes\n", $1}'
@@ -0,0 +1,35 @@
+/* Node footprint and the cost of settling a large promise graph. */
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include "promise.hpp"
+
+using promise::promise_t;
+
+int main() {
+    printf("sizeof(Promise)   = %zu\n", sizeof(promise::Promise));
+    printf("sizeof(promise_t) = %zu\n", sizeof(promise_t));
+    const int width = 1000, depth = 200;
+    for (int round = 0; round < 3; round++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        long sum = 0;
+        /* grow the chains side by side so that the nodes of one chain are
+         * scattered across the heap */
+        std::vector<promise_t> roots(width), tails(roots);
+        for (int d = 0; d < depth; d++)
+            for (auto &t: tails)
+                t = t.then([](int x) { return x + 1; });
+        for (auto &t: tails)
+            t.then([&sum](int x) { sum += x; });
+        auto built = std::chrono::steady_clock::now();
+        for (auto &r: roots) r.resolve(0);
+        auto end = std::chrono::steady_clock::now();
+        printf("build %6lld us, settle %6lld us (%ld)\n",
+            (long long)std::chrono::duration_cast<
+                std::chrono::microseconds>(built - start).count(),
+            (long long)std::chrono::duration_cast<
+                std::chrono::microseconds>(end - built).count(), sum);
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+/* Run the same ten-stage handler per request, rebuilding the then() chain
+ * each time versus instantiating a prebuilt pipeline_t. */
+#include <chrono>
+#include <cstdio>
+#include "promise.hpp"
+
+using promise::promise_t;
+
+const int stages = 10, requests = 100000;
+
+template<typename Func>
+void measure(const char *name, Func &&f) {
+    auto start = std::chrono::steady_clock::now();
+    long r = f();
+    auto end = std::chrono::steady_clock::now();
+    printf("%-28s %8lld us (%ld)\n", name,
+            (long long)std::chrono::duration_cast<
+                std::chrono::microseconds>(end - start).count(), r);
+}
+
+int step(int x) { return x + 1; }
+
+long rebuilt() {
+    long sum = 0;
+    for (int r = 0; r < requests; r++)
+    {
+        promise_t root;
+        promise_t t = root;
+        for (int i = 0; i < stages; i++)
+            t = t.then(step);
+        t.then([&sum](int x) { sum += x; });
+        root.resolve(r);
+    }
+    return sum;
+}
+
+long prebuilt() {
+    long sum = 0;
+    auto pipeline = promise::pipeline_t();
+    for (int i = 0; i < stages; i++)
+        pipeline = pipeline.then(step);
+    pipeline = pipeline.then([&sum](int x) { sum += x; });
+    for (int r = 0; r < requests; r++)
+        pipeline.run(r);
+    return sum;
+}
+
+/* the middle stage waits for a promise resolved after the run starts */
+long rebuilt_async() {
+    long sum = 0;
+    for (int r = 0; r < requests; r++)
+    {
+        promise_t root, io;
+        promise_t t = root;
+        for (int i = 0; i < stages; i++)
+            if (i == stages / 2)
+                t = t.then([&io](int) { return io; });
+            else
+                t = t.then(step);
+        t.then([&sum](int x) { sum += x; });
+        root.resolve(r);
+        io.resolve(r);
+    }
+    return sum;
+}
+
+long prebuilt_async() {
+    long sum = 0;
+    promise_t io;
+    auto pipeline = promise::pipeline_t();
+    for (int i = 0; i < stages; i++)
+        if (i == stages / 2)
+            pipeline = pipeline.then([&io](int) { return io; });
+        else
+            pipeline = pipeline.then(step);
+    pipeline = pipeline.then([&sum](int x) { sum += x; });
+    for (int r = 0; r < requests; r++)
+    {
+        io = promise_t();
+        pipeline.run(r);
+        io.resolve(r);
+    }
+    return sum;
+}
+
+int main() {
+    measure("rebuilt chains", rebuilt);
+    measure("prebuilt pipeline", prebuilt);
+    measure("rebuilt chains (async)", rebuilt_async);
+    measure("prebuilt pipeline (async)", prebuilt_async);
+    return 0;
+}
@@ -0,0 +1,63 @@
+/* Compare the trigger modes: build with no flag (recursive),
+ * -DCPPROMISE_USE_STACK_FREE or -DCPPROMISE_USE_HYBRID. */
+#include <chrono>
+#include <cstdio>
+#include "promise.hpp"
+
+using promise::promise_t;
+
+template<typename Func>
+void measure(const char *name, Func &&f) {
+    auto start = std::chrono::steady_clock::now();
+    long r = f();
+    auto end = std::chrono::steady_clock::now();
+    printf("%-28s %8lld us (%ld)\n", name,
+            (long long)std::chrono::duration_cast<
+                std::chrono::microseconds>(end - start).count(), r);
+}
+
+/* a then() chain of the given length, resolved at the root */
+long chain(int len) {
+    long out = 0;
+    promise_t root;
+    promise_t t = root;
+    for (int i = 0; i < len; i++)
+        t = t.then([](int x) { return x + 1; });
+    t.then([&out](int x) { out = x; });
+    root.resolve(0);
+    return out;
+}
+
+/* each step returns a promise that is resolved later */
+long nested_chain(int len) {
+    long out = 0;
+    std::vector<promise_t> inner(len);
+    promise_t root;
+    promise_t t = root;
+    for (int i = 0; i < len; i++)
+        t = t.then([&inner, i](int x) {
+            return inner[i].then([x]() { return x + 1; });
+        });
+    t.then([&out](int x) { out = x; });
+    root.resolve(0);
+    for (int i = 0; i < len; i++) inner[i].resolve();
+    return out;
+}
+
+int main() {
+    measure("shallow chains (100 x 1e4)", []() {
+        long s = 0;
+        for (int i = 0; i < 10000; i++) s += chain(100);
+        return s;
+    });
+    measure("nested chains (100 x 1e3)", []() {
+        long s = 0;
+        for (int i = 0; i < 1000; i++) s += nested_chain(100);
+        return s;
+    });
+#if defined(CPPROMISE_USE_STACK_FREE) || defined(CPPROMISE_USE_HYBRID)
+    /* would overflow the stack in recursive mode */
+    measure("deep chain (1e6)", []() { return chain(1000000); });
+#endif
+    return 0;
+}
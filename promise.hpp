@@ -24,12 +24,31 @@
  * SOFTWARE.
  */
 
+#include <list>
+#include <deque>
 #include <stack>
+#include <stdexcept>
 #include <vector>
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+#include <unordered_map>
 #include <memory>
 #include <functional>
 #include <type_traits>
 
+#ifdef __linux__
+#include <ctime>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <mutex>
+#include <condition_variable>
+#endif
+
 #if __cplusplus >= 201703L
 #ifdef __has_include
 #   if __has_include(<any>)
@@ -45,6 +64,12 @@
 #include <boost/any.hpp>
 #endif
 
+/* in hybrid mode, the number of nested triggers before falling back to an
+ * iterative trampoline */
+#ifndef CPPROMISE_HYBRID_DEPTH
+#define CPPROMISE_HYBRID_DEPTH 128
+#endif
+
 /**
  * Implement type-safe Promise primitives similar to the ones specified by
  * Javascript Promise/A+.
@@ -65,6 +90,18 @@ namespace promise {
 #endif
     using callback_t = std::function<void()>;
     using values_t = std::vector<pm_any_t>;
+#ifdef CPPROMISE_USE_ATOMIC_REFCNT
+    using ref_cnt_t = std::atomic<size_t>;
+#else
+    using ref_cnt_t = size_t;
+#endif
+
+    /* thrown by promise_t::get() when the promise is rejected */
+    struct rejected_error: public std::runtime_error {
+        pm_any_t reason;
+        rejected_error(pm_any_t reason):
+            std::runtime_error("promise rejected"), reason(std::move(reason)) {}
+    };
 
     /* match lambdas */
     template<typename T>
@@ -85,6 +122,14 @@ namespace promise {
         using arg_type = ArgType;
         using non_empty_arg = void;
     };
+
+    /* match plain functions taking two arguments (folds) */
+    template<typename ReturnType, typename ArgType1, typename ArgType2>
+    struct function_traits_impl<ReturnType(ArgType1, ArgType2)> {
+        using ret_type = ReturnType;
+        using arg_type = ArgType1;
+        using arg2_type = ArgType2;
+    };
  
     /* match function pointers */
     template<typename ReturnType, typename... ArgType>
@@ -131,14 +176,28 @@ namespace promise {
                 std::remove_cv_t<std::remove_reference_t<T>>, U>::value>;
 
     class Promise;
+    class promise_t;
+    class pipeline_t;
+
+    template<typename Range, typename Func, typename Sink>
+    promise_t map_limited_each(const Range &range, Func &&f, size_t max_inflight,
+                                Sink &&on_result, bool stop_on_reject = true);
+
+    template<typename PList, typename T, typename Fold>
+    promise_t reduce(const PList &promise_list, T init, Fold &&fold,
+                    bool ordered = false);
+
     //class promise_t: public std::shared_ptr<Promise> {
     class promise_t {
         Promise *pm;
-        size_t *ref_cnt;
         public:
         friend Promise;
         template<typename PList> friend promise_t all(const PList &promise_list);
         template<typename PList> friend promise_t race(const PList &promise_list);
+        template<typename PList> friend promise_t some(size_t k, const PList &promise_list);
+        template<typename Func, typename Timer> friend promise_t hedge(Func &&attempt, Timer &&delay);
+        friend promise_t resolved(pm_any_t result);
+        friend promise_t rejected(pm_any_t reason);
 
         inline promise_t();
         inline ~promise_t();
@@ -147,7 +206,6 @@ namespace promise {
 
         void swap(promise_t &other) {
             std::swap(pm, other.pm);
-            std::swap(ref_cnt, other.ref_cnt);
         }
 
         promise_t &operator=(const promise_t &other) {
@@ -168,15 +226,9 @@ namespace promise {
             return *this;
         }
 
-        promise_t(const promise_t &other):
-            pm(other.pm),
-            ref_cnt(other.ref_cnt) {
-            ++*ref_cnt;
-        }
+        inline promise_t(const promise_t &other);
 
-        promise_t(promise_t &&other):
-            pm(other.pm),
-            ref_cnt(other.ref_cnt) {
+        promise_t(promise_t &&other): pm(other.pm) {
             other.pm = nullptr;
         }
 
@@ -198,407 +250,540 @@ namespace promise {
 
         template<typename FuncRejected>
         inline promise_t fail(FuncRejected &&on_rejected) const;
+
+        inline void wait() const;
+        template<typename Rep, typename Period>
+        inline bool wait_for(const std::chrono::duration<Rep, Period> &timeout) const;
+        inline pm_any_t get() const;
+        template<typename T> inline T get() const;
+
+        private:
+        inline explicit promise_t(Promise *pm);
     };
 
+    /**
+     * Receives the outcome of a callback: a returned value settles the
+     * subsequent promise, a returned promise_t is followed.
+     */
+    class step_out_t {
+        protected:
+        ~step_out_t() {}
+        public:
+        virtual void settle(pm_any_t value) = 0;
+        virtual void follow(promise_t pm) = 0;
+    };
+
+    /* type-erased callback adapter, the only code generated per call site */
+    using step_t = std::function<void(const pm_any_t &, step_out_t &)>;
+
 #define PROMISE_ERR_INVALID_STATE do {throw std::runtime_error("invalid promise state");} while (0)
 #define PROMISE_ERR_MISMATCH_TYPE do {throw std::runtime_error("mismatching promise value types");} while (0)
+#define PROMISE_ERR_INVALID_QUORUM do {throw std::runtime_error("invalid quorum size");} while (0)
     
     class Promise {
         template<typename PList> friend promise_t all(const PList &promise_list);
         template<typename PList> friend promise_t race(const PList &promise_list);
-        std::vector<callback_t> fulfilled_callbacks;
-        std::vector<callback_t> rejected_callbacks;
-#ifdef CPPROMISE_USE_STACK_FREE
-        std::vector<Promise *> fulfilled_pms;
-        std::vector<Promise *> rejected_pms;
-#endif
+        template<typename PList> friend promise_t some(size_t k, const PList &promise_list);
+        template<typename Func, typename Timer> friend promise_t hedge(Func &&attempt, Timer &&delay);
+        friend promise_t resolved(pm_any_t result);
+        friend promise_t rejected(pm_any_t reason);
+        friend promise_t;
+        friend pipeline_t;
+        template<typename Range, typename Func, typename Sink>
+        friend promise_t map_limited_each(const Range &range, Func &&f, size_t max_inflight,
+                                        Sink &&on_result, bool stop_on_reject);
+        template<typename PList, typename T, typename Fold>
+        friend promise_t reduce(const PList &promise_list, T init, Fold &&fold,
+                                bool ordered);
         enum class State {
             Pending,
 #ifdef CPPROMISE_USE_STACK_FREE
             PreFulfilled,
             PreRejected,
+#endif
+#ifdef CPPROMISE_USE_HYBRID
+            /* settled, but the continuations are put off by the trampoline */
+            DeferredFulfilled,
+            DeferredRejected,
 #endif
             Fulfilled,
             Rejected,
-        } state;
-        pm_any_t result;
-        pm_any_t reason;
+        };
+
+        /* a continuation registered by then(), an empty step passes the
+         * value on to npm as is; aligned to leave three tag bits for the
+         * state in pointers to it */
+        struct alignas(8) cont_t {
+            cont_t *next;
+            step_t on_fulfilled;
+            step_t on_rejected;
+            promise_t npm;
+#ifdef CPPROMISE_USE_STACK_FREE
+            /* only makes the traversal visit npm */
+            bool dep_only;
+#endif
+        };
+
+        /* owns a list of continuations detached from a node */
+        struct cont_list_t {
+            cont_t *first;
+            explicit cont_list_t(cont_t *first): first(first) {}
+            cont_list_t(cont_list_t &&other): first(other.first) {
+                other.first = nullptr;
+            }
+            cont_list_t &operator=(cont_list_t &&other) {
+                std::swap(first, other.first);
+                return *this;
+            }
+            ~cont_list_t() {
+                while (first)
+                {
+                    cont_t *next = first->next;
+                    delete first;
+                    first = next;
+                }
+            }
+        };
+
+        /* the continuation list (newest first), with the state in the low
+         * bits of the pointer */
+        uintptr_t head;
+        ref_cnt_t ref_cnt;
+        /* the result if fulfilled, or the reason if rejected */
+        pm_any_t value;
+        /* mirrors the settlement for waiters on other threads */
+        std::atomic<uint32_t> wait_word;
 
-        void add_on_fulfilled(callback_t &&cb) {
-            fulfilled_callbacks.push_back(std::move(cb));
+        static constexpr uintptr_t state_mask = 7;
+
+        State get_state() const { return State(head & state_mask); }
+
+        void set_state(State state) {
+            head = (head & ~state_mask) | uintptr_t(state);
         }
 
-        void add_on_rejected(callback_t &&cb) {
-            rejected_callbacks.push_back(std::move(cb));
+        cont_t *conts() const {
+            return reinterpret_cast<cont_t *>(head & ~state_mask);
         }
 
-        template<typename Func,
-            typename function_traits<Func>::non_empty_arg * = nullptr>
-        static constexpr auto cps_transform(
-                Func &&f, const pm_any_t &result, const promise_t &npm) {
-            return [&result, npm, f = std::forward<Func>(f)]() mutable {
-#ifndef CPPROMISE_USE_STACK_FREE
-                f(result)->then(
-                    [npm] (pm_any_t result) {npm->resolve(result);},
-                    [npm] (pm_any_t reason) {npm->reject(reason);});
-#else
-                promise_t rpm{f(result)};
-                rpm->then(
-                    [rpm, npm] (pm_any_t result) {
-                        npm->_resolve(result);
-                    },
-                    [rpm, npm] (pm_any_t reason) {
-                        npm->_reject(reason);
-                    });
-                rpm->_dep_resolve(npm);
-                rpm->_dep_reject(npm);
+        void push_cont(step_t on_fulfilled, step_t on_rejected,
+                        const promise_t &npm, bool dep_only = false) {
+            auto c = new cont_t{conts(), std::move(on_fulfilled),
+                                std::move(on_rejected), npm
+#ifdef CPPROMISE_USE_STACK_FREE
+                                , dep_only
 #endif
             };
+            (void)dep_only;
+            head = reinterpret_cast<uintptr_t>(c) | (head & state_mask);
         }
 
-        template<typename Func,
-            typename function_traits<Func>::empty_arg * = nullptr>
-        static constexpr auto cps_transform(
-                Func &&f, const pm_any_t &, const promise_t &npm) {
-            return [npm, f = std::forward<Func>(f)]() mutable {
-#ifndef CPPROMISE_USE_STACK_FREE
-                f()->then(
-                    [npm] (pm_any_t result) {npm->resolve(result);},
-                    [npm] (pm_any_t reason) {npm->reject(reason);});
-#else
-                promise_t rpm{f()};
-                rpm->then(
-                    [rpm, npm] (pm_any_t result) {
-                        npm->_resolve(result);
-                    },
-                    [rpm, npm] (pm_any_t reason) {
-                        npm->_reject(reason);
-                    });
-                rpm->_dep_resolve(npm);
-                rpm->_dep_reject(npm);
-#endif
-            };
+        /* detach the continuations, in the order they were registered */
+        cont_list_t take_conts() {
+            cont_t *first = nullptr;
+            for (cont_t *c = conts(), *next; c; c = next)
+            {
+                next = c->next;
+                c->next = first;
+                first = c;
+            }
+            head &= state_mask;
+            return cont_list_t(first);
         }
 
-        template<typename Func,
-            enable_if_return<Func, promise_t> * = nullptr>
-        constexpr auto gen_on_fulfilled(Func &&on_fulfilled, const promise_t &npm) {
-            return cps_transform(std::forward<Func>(on_fulfilled), this->result, npm);
+        static constexpr uint32_t wait_fulfilled = 1;
+        static constexpr uint32_t wait_rejected = 2;
+        static constexpr uint32_t wait_parked = 4;
+
+#ifdef __linux__
+        static bool park(std::atomic<uint32_t> &word, uint32_t expected,
+                        const std::chrono::steady_clock::time_point *deadline) {
+            struct timespec ts, *tsp = nullptr;
+            if (deadline)
+            {
+                auto left = *deadline - std::chrono::steady_clock::now();
+                if (left <= left.zero()) return false;
+                auto sec = std::chrono::duration_cast<std::chrono::seconds>(left);
+                ts.tv_sec = sec.count();
+                ts.tv_nsec = std::chrono::duration_cast<
+                    std::chrono::nanoseconds>(left - sec).count();
+                tsp = &ts;
+            }
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word),
+                    FUTEX_WAIT_PRIVATE, expected, tsp, nullptr, 0);
+            return true;
         }
 
-        template<typename Func,
-            enable_if_return<Func, promise_t> * = nullptr>
-        constexpr auto gen_on_rejected(Func &&on_rejected, const promise_t &npm) {
-            return cps_transform(std::forward<Func>(on_rejected), this->reason, npm);
+        static void unpark_all(std::atomic<uint32_t> &word) {
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word),
+                    FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
         }
+#else
+        /* no futex, park on a condition variable hashed by address */
+        struct parking_slot_t {
+            std::mutex m;
+            std::condition_variable cv;
+        };
 
+        static parking_slot_t &parking_slot(const void *addr) {
+            static parking_slot_t slots[64];
+            return slots[(reinterpret_cast<uintptr_t>(addr) >> 4) % 64];
+        }
 
-        template<typename Func,
-            enable_if_return<Func, void> * = nullptr,
-            typename function_traits<Func>::non_empty_arg * = nullptr>
-        constexpr auto gen_on_fulfilled(Func &&on_fulfilled, const promise_t &npm) {
-            return [this, npm,
-                    on_fulfilled = std::forward<Func>(on_fulfilled)]() mutable {
-                on_fulfilled(result);
-                npm->_resolve();
-            };
+        static bool park(std::atomic<uint32_t> &word, uint32_t expected,
+                        const std::chrono::steady_clock::time_point *deadline) {
+            auto &slot = parking_slot(&word);
+            std::unique_lock<std::mutex> lk(slot.m);
+            if (word.load(std::memory_order_relaxed) != expected) return true;
+            if (!deadline)
+                slot.cv.wait(lk);
+            else if (slot.cv.wait_until(lk, *deadline) == std::cv_status::timeout)
+                return false;
+            return true;
         }
 
-        template<typename Func,
-            enable_if_return<Func, void> * = nullptr,
-            typename function_traits<Func>::empty_arg * = nullptr>
-        constexpr auto gen_on_fulfilled(Func &&on_fulfilled, const promise_t &npm) {
-            return [on_fulfilled = std::forward<Func>(on_fulfilled), npm]() mutable {
-                on_fulfilled();
-                npm->_resolve();
-            };
+        static void unpark_all(std::atomic<uint32_t> &word) {
+            auto &slot = parking_slot(&word);
+            { std::lock_guard<std::mutex> lk(slot.m); }
+            slot.cv.notify_all();
         }
+#endif
 
-        template<typename Func,
-            enable_if_return<Func, void> * = nullptr,
-            typename function_traits<Func>::non_empty_arg * = nullptr>
-        constexpr auto gen_on_rejected(Func &&on_rejected, const promise_t &npm) {
-            return [this, npm,
-                    on_rejected = std::forward<Func>(on_rejected)]() mutable {
-                on_rejected(reason);
-                npm->_reject();
-            };
+        static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__)
+            asm volatile("yield");
+#endif
         }
 
-        template<typename Func,
-            enable_if_return<Func, void> * = nullptr,
-            typename function_traits<Func>::empty_arg * = nullptr>
-        constexpr auto gen_on_rejected(Func &&on_rejected, const promise_t &npm) {
-            return [npm,
-                    on_rejected = std::forward<Func>(on_rejected)]() mutable {
-                on_rejected();
-                npm->_reject();
-            };
+        /* called once the node is settled and its callbacks have run (or
+         * have been put off, in hybrid mode) */
+        void notify_settled() {
+            uint32_t v = get_state() == State::Fulfilled ? wait_fulfilled : wait_rejected;
+            if (wait_word.exchange(v, std::memory_order_release) & wait_parked)
+                unpark_all(wait_word);
         }
 
-        template<typename Func,
-            enable_if_return<Func, pm_any_t> * = nullptr,
-            typename function_traits<Func>::non_empty_arg * = nullptr>
-        constexpr auto gen_on_fulfilled(Func &&on_fulfilled, const promise_t &npm) {
-            return [this, npm,
-                    on_fulfilled = std::forward<Func>(on_fulfilled)]() mutable {
-                npm->_resolve(on_fulfilled(result));
-            };
+        /* block until settled or past `deadline`, return the settlement */
+        uint32_t _wait(const std::chrono::steady_clock::time_point *deadline) {
+            static thread_local uint32_t spin_limit = 64;
+            uint32_t w = wait_word.load(std::memory_order_acquire);
+            if (w & ~wait_parked) return w;
+            /* spin briefly before going to sleep, adapting the spin length to
+             * whether spinning paid off last time */
+            for (uint32_t i = 0; i < spin_limit; i++)
+            {
+                cpu_relax();
+                w = wait_word.load(std::memory_order_acquire);
+                if (w & ~wait_parked)
+                {
+                    if (spin_limit < 4096) spin_limit <<= 1;
+                    return w;
+                }
+            }
+            if (spin_limit > 16) spin_limit >>= 1;
+            for (;;)
+            {
+                if (!(w & wait_parked) &&
+                    !wait_word.compare_exchange_weak(w, w | wait_parked,
+                                                    std::memory_order_acquire))
+                {
+                    if (w & ~wait_parked) return w;
+                    continue;
+                }
+                if (!park(wait_word, wait_parked, deadline)) return 0;
+                w = wait_word.load(std::memory_order_acquire);
+                if (w & ~wait_parked) return w;
+            }
         }
 
-        template<typename Func,
-            enable_if_return<Func, pm_any_t> * = nullptr,
-            typename function_traits<Func>::empty_arg * = nullptr>
-        constexpr auto gen_on_fulfilled(Func &&on_fulfilled, const promise_t &npm) {
-            return [npm, on_fulfilled = std::forward<Func>(on_fulfilled)]() mutable {
-                npm->_resolve(on_fulfilled());
-            };
+        /* settle npm the same way as this (pending) promise */
+        void pipe(const promise_t &npm) {
+            push_cont(step_t(), step_t(), npm);
         }
 
-        template<typename Func,
-            enable_if_return<Func, pm_any_t> * = nullptr,
-            typename function_traits<Func>::non_empty_arg * = nullptr>
-        constexpr auto gen_on_rejected(Func &&on_rejected, const promise_t &npm) {
-            return [this, npm, on_rejected = std::forward<Func>(on_rejected)]() mutable {
-                npm->_reject(on_rejected(reason));
-            };
+        /* settle npm the same way as rpm, taking the value directly if rpm
+         * is already settled; returns whether it was, in which case the
+         * caller is responsible for triggering npm */
+        static bool follow(const promise_t &rpm, const promise_t &npm) {
+            switch (rpm->get_state())
+            {
+                case State::Fulfilled:
+                npm->_resolve(rpm->value);
+                return true;
+                case State::Rejected:
+                npm->_reject(rpm->value);
+                return true;
+                default:
+                rpm->pipe(npm);
+                return false;
+            }
         }
 
-        template<typename Func,
-            enable_if_return<Func, pm_any_t> * = nullptr,
-            typename function_traits<Func>::empty_arg * = nullptr>
-        constexpr auto gen_on_rejected(Func &&on_rejected, const promise_t &npm) {
-            return [npm, on_rejected = std::forward<Func>(on_rejected)]() mutable {
-                npm->_reject(on_rejected());
-            };
+        /* settle npm the same way as rpm, from outside of any traversal */
+        static void forward(const promise_t &rpm, const promise_t &npm) {
+            if (follow(rpm, npm)) npm->_trigger();
+        }
+
+        struct npm_out_t: public step_out_t {
+            const promise_t &npm;
+            bool rejected;
+            npm_out_t(const promise_t &npm, bool rejected):
+                npm(npm), rejected(rejected) {}
+            void settle(pm_any_t value) override {
+                if (rejected)
+                    npm->_reject(std::move(value));
+                else
+                    npm->_resolve(std::move(value));
+            }
+            /* npm is triggered by the then() or the traversal running the
+             * step, so that a long chain does not nest traversals */
+            void follow(promise_t pm) override { Promise::follow(pm, npm); }
+        };
+
+        /* feed the value to the step (or pass it on) and settle npm with
+         * the outcome */
+        static void run_step(const step_t &step, const pm_any_t &value,
+                            bool rejected, const promise_t &npm) {
+            if (!step)
+            {
+                if (rejected)
+                    npm->_reject(value);
+                else
+                    npm->_resolve(value);
+                return;
+            }
+            npm_out_t out(npm, rejected);
+            step(value, out);
+        }
+
+        static void run_conts(const cont_list_t &conts,
+                            const pm_any_t &value, bool rejected) {
+            for (const cont_t *c = conts.first; c; c = c->next)
+            {
+#ifdef CPPROMISE_USE_STACK_FREE
+                if (c->dep_only) continue;
+#endif
+                run_step(rejected ? c->on_rejected : c->on_fulfilled,
+                        value, rejected, c->npm);
+            }
         }
 
 #ifdef CPPROMISE_USE_STACK_FREE
         void _trigger() {
-            std::stack<std::tuple<
-                std::vector<Promise *>::const_iterator,
-                std::vector<Promise *> *,
-                Promise *>> s;
+            /* a frame keeps the continuations of a settled node alive until
+             * all their npms are visited */
+            std::stack<std::pair<cont_list_t, const cont_t *>> s;
             auto push_frame = [&s](Promise *pm) {
-                if (pm->state == State::PreFulfilled)
-                {
-                    pm->state = State::Fulfilled;
-                    for (auto &cb: pm->fulfilled_callbacks) cb();
-                    s.push(std::make_tuple(pm->fulfilled_pms.begin(),
-                                          &pm->fulfilled_pms,
-                                          pm));
-                }
-                else if (pm->state == State::PreRejected)
-                {
-                    pm->state = State::Rejected;
-                    for (auto &cb: pm->rejected_callbacks) cb();
-                    s.push(std::make_tuple(pm->rejected_pms.begin(),
-                                          &pm->rejected_pms,
-                                          pm));
-                }
+                State state = pm->get_state();
+                if (state != State::PreFulfilled && state != State::PreRejected)
+                    return;
+                bool rejected = state == State::PreRejected;
+                pm->set_state(rejected ? State::Rejected : State::Fulfilled);
+                cont_list_t conts = pm->take_conts();
+                run_conts(conts, pm->value, rejected);
+                pm->notify_settled();
+                const cont_t *first = conts.first;
+                s.emplace(std::move(conts), first);
             };
             push_frame(this);
             while (!s.empty())
             {
-                auto &u = s.top();
-                auto &it = std::get<0>(u);
-                auto vec = std::get<1>(u);
-                auto pm = std::get<2>(u);
-                if (it == vec->end())
+                auto &it = s.top().second;
+                if (!it)
                 {
                     s.pop();
-                    vec->clear();
-                    pm->fulfilled_callbacks.clear();
-                    pm->rejected_callbacks.clear();
                     continue;
                 }
-                push_frame(*it++);
+                Promise *pm = it->npm.pm;
+                it = it->next;
+                push_frame(pm);
             }
         }
 
         void trigger_fulfill() {
-            state = State::PreFulfilled;
+            set_state(State::PreFulfilled);
             _trigger();
         }
 
         void trigger_reject() {
-            state = State::PreRejected;
+            set_state(State::PreRejected);
             _trigger();
         }
 
         void _resolve() {
-            if (state == State::Pending) state = State::PreFulfilled;
+            if (get_state() == State::Pending) set_state(State::PreFulfilled);
         }
 
         void _reject() {
-            if (state == State::Pending) state = State::PreRejected;
+            if (get_state() == State::Pending) set_state(State::PreRejected);
         }
 
-        void _dep_resolve(const promise_t &npm) {
-            if (state == State::Pending)
-                fulfilled_pms.push_back(npm.pm);
-            else
-                npm->_trigger();
+        /* whether the traversal has not reached this node yet */
+        bool _unsettled() const {
+            State state = get_state();
+            return state != State::Fulfilled && state != State::Rejected;
         }
 
-        void _dep_reject(const promise_t &npm) {
-            if (state == State::Pending)
-                rejected_pms.push_back(npm.pm);
+        /* make the traversal from this node visit npm */
+        void _dep(const promise_t &npm) {
+            if (_unsettled())
+                push_cont(step_t(), step_t(), npm, true);
             else
                 npm->_trigger();
         }
 
         void _resolve(pm_any_t _result) {
-            if (state == State::Pending)
+            if (get_state() == State::Pending)
             {
-                result = _result;
-                state = State::PreFulfilled;
+                value = std::move(_result);
+                set_state(State::PreFulfilled);
             }
         }
 
         void _reject(pm_any_t _reason) {
-            if (state == State::Pending)
+            if (get_state() == State::Pending)
             {
-                reason = _reason;
-                state = State::PreRejected;
+                value = std::move(_reason);
+                set_state(State::PreRejected);
             }
         }
 #else
+        /* settlement is propagated eagerly, nothing left to trigger */
+        void _trigger() {}
+        void _dep(const promise_t &) {}
+
         void _resolve() { resolve(); }
         void _reject() { reject(); }
-        void _resolve(pm_any_t result) { resolve(result); }
-        void _reject(pm_any_t reason) { reject(reason); }
+        void _resolve(pm_any_t result) { resolve(std::move(result)); }
+        void _reject(pm_any_t reason) { reject(std::move(reason)); }
 
-        void trigger_fulfill() {
-            state = State::Fulfilled;
-            for (const auto &cb: fulfilled_callbacks) cb();
-            fulfilled_callbacks.clear();
+#ifdef CPPROMISE_USE_HYBRID
+
+        static size_t &hybrid_depth() {
+            static thread_local size_t depth = 0;
+            return depth;
         }
 
-        void trigger_reject() {
-            state = State::Rejected;
-            for (const auto &cb: rejected_callbacks) cb();
-            rejected_callbacks.clear();
+        /* settled promises whose continuations are put off */
+        static std::deque<promise_t> &hybrid_deferred() {
+            static thread_local std::deque<promise_t> deferred;
+            return deferred;
         }
-#endif
-        public:
 
-        Promise(): state(State::Pending) {}
-        ~Promise() {}
+        struct depth_guard_t {
+            size_t &depth;
+            depth_guard_t(size_t &depth): depth(depth) { depth++; }
+            ~depth_guard_t() { depth--; }
+        };
 
-        template<typename FuncFulfilled, typename FuncRejected>
-        promise_t then(FuncFulfilled &&on_fulfilled,
-                      FuncRejected &&on_rejected) {
-            switch (state)
+        /* run the put-off continuations from the bottom of the stack */
+        static void hybrid_drain() {
+            auto &deferred = hybrid_deferred();
+            while (!deferred.empty())
             {
-                case State::Pending:
-                return promise_t([this,
-                                on_fulfilled = std::forward<FuncFulfilled>(on_fulfilled),
-                                on_rejected = std::forward<FuncRejected>(on_rejected)
-                                ](promise_t &npm) {
-                    add_on_fulfilled(gen_on_fulfilled(std::move(on_fulfilled), npm));
-                    add_on_rejected(gen_on_rejected(std::move(on_rejected), npm));
-#ifdef CPPROMISE_USE_STACK_FREE
-                    _dep_resolve(npm);
-                    _dep_reject(npm);
-#endif
-                });
-                case State::Fulfilled:
-                return promise_t([this,
-                                on_fulfilled = std::forward<FuncFulfilled>(on_fulfilled)
-                                ](promise_t &npm) {
-                    gen_on_fulfilled(std::move(on_fulfilled), npm)();
-                });
-                case State::Rejected:
-                return promise_t([this,
-                                on_rejected = std::forward<FuncRejected>(on_rejected)
-                                ](promise_t &npm) {
-                    gen_on_rejected(std::move(on_rejected), npm)();
-                });
-                default: PROMISE_ERR_INVALID_STATE;
+                promise_t pm = std::move(deferred.front());
+                deferred.pop_front();
+                depth_guard_t guard(hybrid_depth());
+                pm->run_settled(pm->get_state() == State::DeferredRejected);
             }
         }
 
-        template<typename FuncFulfilled>
-        promise_t then(FuncFulfilled &&on_fulfilled) {
-            switch (state)
+        /* recurse into the continuations while within the depth budget,
+         * otherwise leave them to the outermost trigger; until then the
+         * promise stays in a Deferred state, so that a then() registered
+         * meanwhile is queued behind them instead of running first */
+        void dispatch(bool rejected) {
+            auto &depth = hybrid_depth();
+            if (depth >= CPPROMISE_HYBRID_DEPTH)
             {
-                case State::Pending:
-                return promise_t([this,
-                                on_fulfilled = std::forward<FuncFulfilled>(on_fulfilled)
-                                ](promise_t &npm) {
-                    add_on_fulfilled(gen_on_fulfilled(std::move(on_fulfilled), npm));
-                    add_on_rejected([this, npm]() {npm->_reject(reason);});
-#ifdef CPPROMISE_USE_STACK_FREE
-                    _dep_resolve(npm);
-                    _dep_reject(npm);
-#endif
-                });
-                case State::Fulfilled:
-                return promise_t([this,
-                                on_fulfilled = std::forward<FuncFulfilled>(on_fulfilled)
-                                ](promise_t &npm) {
-                    gen_on_fulfilled(std::move(on_fulfilled), npm)();
-                });
-                case State::Rejected:
-                return promise_t([this](promise_t &npm) {npm->_reject(reason);});
-                default: PROMISE_ERR_INVALID_STATE;
+                set_state(rejected ? State::DeferredRejected : State::DeferredFulfilled);
+                ++ref_cnt;
+                hybrid_deferred().push_back(promise_t(this));
+                return;
             }
-        }
- 
-        template<typename FuncRejected>
-        promise_t fail(FuncRejected &&on_rejected) {
-            switch (state)
             {
-                case State::Pending:
-                return promise_t([this,
-                                on_rejected = std::forward<FuncRejected>(on_rejected)
-                                ](promise_t &npm) {
-                    callback_t ret;
-                    add_on_rejected(gen_on_rejected(std::move(on_rejected), npm));
-                    add_on_fulfilled([this, npm]() {npm->_resolve(result);});
-#ifdef CPPROMISE_USE_STACK_FREE
-                    _dep_resolve(npm);
-                    _dep_reject(npm);
+                depth_guard_t guard(depth);
+                run_settled(rejected);
+            }
+            if (!depth) hybrid_drain();
+        }
+#else
+        void dispatch(bool rejected) { run_settled(rejected); }
 #endif
-                });
+
+        void run_settled(bool rejected) {
+            set_state(rejected ? State::Rejected : State::Fulfilled);
+            run_conts(take_conts(), value, rejected);
+            notify_settled();
+        }
+
+        void trigger_fulfill() { dispatch(false); }
+        void trigger_reject() { dispatch(true); }
+#endif
+        public:
+
+        Promise(): head(uintptr_t(State::Pending)), ref_cnt(1), wait_word(0) {}
+        ~Promise() { cont_list_t dropped(conts()); }
+
+        /* an empty step passes the value on as is */
+        promise_t then(step_t on_fulfilled, step_t on_rejected) {
+            promise_t npm;
+            switch (get_state())
+            {
                 case State::Fulfilled:
-                return promise_t([this](promise_t &npm) {npm->_resolve(result);});
+                run_step(on_fulfilled, value, false, npm);
+                npm->_trigger();
+                break;
                 case State::Rejected:
-                return promise_t([this,
-                                on_rejected = std::forward<FuncRejected>(on_rejected)
-                                ](promise_t &npm) {
-                    gen_on_rejected(std::move(on_rejected), npm)();
-                });
-                default: PROMISE_ERR_INVALID_STATE;
+                run_step(on_rejected, value, true, npm);
+                npm->_trigger();
+                break;
+                default:
+                push_cont(std::move(on_fulfilled), std::move(on_rejected), npm);
             }
+            return npm;
+        }
+
+        promise_t then(step_t on_fulfilled) {
+            return then(std::move(on_fulfilled), step_t());
+        }
+
+        promise_t fail(step_t on_rejected) {
+            return then(step_t(), std::move(on_rejected));
         }
-  
+
         void resolve() {
-            if (state == State::Pending) trigger_fulfill();
+            if (get_state() == State::Pending) trigger_fulfill();
         }
 
         void reject() {
-            if (state == State::Pending) trigger_reject();
+            if (get_state() == State::Pending) trigger_reject();
         }
 
         void resolve(pm_any_t _result) {
-            if (state == State::Pending)
+            if (get_state() == State::Pending)
             {
-                result = _result;
+                value = std::move(_result);
                 trigger_fulfill();
             }
         }
 
         void reject(pm_any_t _reason) {
-            if (state == State::Pending)
+            if (get_state() == State::Pending)
             {
-                reason = _reason;
+                value = std::move(_reason);
                 trigger_reject();
             }
         }
     };
-        
+
+    /* the tagged continuation head, the reference count, the value slot and
+     * the wait word */
+    static_assert(sizeof(Promise) <= 3 * sizeof(void *) + sizeof(pm_any_t),
+                "Promise node is larger than expected");
+
     template<typename PList> promise_t all(const PList &promise_list) {
         return promise_t([&promise_list] (promise_t &npm) {
             auto size = std::make_shared<size_t>(promise_list.size());
@@ -607,17 +792,14 @@ namespace promise {
             results->resize(*size);
             size_t idx = 0;
             for (const auto &pm: promise_list) {
-                pm->then(
+                pm.then(
                     [results, size, idx, npm](pm_any_t result) {
                         (*results)[idx] = result;
                         if (!--(*size))
                             npm->_resolve(*results);
                     },
                     [npm](pm_any_t reason) {npm->_reject(reason);});
-#ifdef CPPROMISE_USE_STACK_FREE
-                pm->_dep_resolve(npm);
-                pm->_dep_reject(npm);
-#endif
+                pm->_dep(npm);
                 idx++;
             }
         });
@@ -625,34 +807,199 @@ namespace promise {
 
     template<typename PList> promise_t race(const PList &promise_list) {
         return promise_t([&promise_list] (promise_t &npm) {
+            for (const auto &pm: promise_list)
+                Promise::forward(pm, npm);
+        });
+    }
+
+    template<typename PList> promise_t some(size_t k, const PList &promise_list) {
+        return promise_t([k, &promise_list] (promise_t &npm) {
+            /* a single shared state for the whole join */
+            struct quorum_t {
+                size_t need;    /* fulfillments still needed */
+                size_t spare;   /* rejections that can still be tolerated */
+                values_t results;
+                quorum_t(size_t need, size_t spare):
+                    need(need), spare(spare) { results.reserve(need); }
+            };
+            size_t size = promise_list.size();
+            if (!k || k > size) PROMISE_ERR_INVALID_QUORUM;
+            auto q = std::make_shared<quorum_t>(k, size - k);
             for (const auto &pm: promise_list) {
-                pm->then([npm](pm_any_t result) {npm->_resolve(result);},
-                        [npm](pm_any_t reason) {npm->_reject(reason);});
-#ifdef CPPROMISE_USE_STACK_FREE
-                pm->_dep_resolve(npm);
-                pm->_dep_reject(npm);
-#endif
+                pm.then(
+                    [q, npm](pm_any_t result) {
+                        /* the join is settled, ignore the losers */
+                        if (!q->need) return;
+                        q->results.push_back(result);
+                        if (!--q->need)
+                            npm->_resolve(values_t(std::move(q->results)));
+                    },
+                    [q, npm](pm_any_t reason) {
+                        if (!q->need) return;
+                        if (q->spare) { q->spare--; return; }
+                        /* k is no longer reachable */
+                        q->need = 0;
+                        values_t().swap(q->results);
+                        npm->_reject(reason);
+                    });
+                pm->_dep(npm);
             }
         });
     }
 
+    template<typename Func, typename Timer>
+    promise_t hedge(Func &&attempt, Timer &&delay) {
+        return promise_t([&attempt, &delay] (promise_t &npm) {
+            Promise::forward(attempt(), npm);
+            /* only start the backup if the first attempt is still running */
+            delay().then([npm, attempt = std::forward<Func>(attempt)]() mutable {
+                if (npm->get_state() == Promise::State::Pending)
+                    Promise::forward(attempt(), npm);
+            });
+        });
+    }
+
+    /**
+     * Invoke `f` (which returns a promise_t) on each element of `range`, with
+     * at most `max_inflight` of the returned promises pending at a time.
+     * `on_result(idx, result)` is called in completion order. The range must
+     * outlive the created promise.
+     */
+    template<typename Range, typename Func, typename Sink>
+    promise_t map_limited_each(const Range &range, Func &&f, size_t max_inflight,
+                                Sink &&on_result, bool stop_on_reject) {
+        return promise_t([&range, &f, max_inflight, &on_result, stop_on_reject]
+                        (promise_t &npm) {
+            using iter_t = decltype(std::begin(range));
+            struct pump_t {
+                iter_t cur, end;
+                std::decay_t<Func> f;
+                std::decay_t<Sink> on_result;
+                size_t max_inflight;
+                bool stop_on_reject;
+                promise_t npm;
+                size_t idx, inflight;
+                bool pumping, done, rejected;
+                pm_any_t reason;
+
+                static void run(const std::shared_ptr<pump_t> &p) {
+                    /* a settled task re-enters here, let the outer loop go on */
+                    if (p->pumping) return;
+                    p->pumping = true;
+                    while (!p->done && p->inflight < p->max_inflight &&
+                            p->cur != p->end)
+                    {
+                        size_t idx = p->idx++;
+                        promise_t pm = p->f(*p->cur++);
+                        p->inflight++;
+                        pm.then(
+                            [p, idx](pm_any_t result) {
+                                p->inflight--;
+                                if (p->done) return;
+                                p->on_result(idx, result);
+                                run(p);
+                            },
+                            [p](pm_any_t reason) {
+                                p->inflight--;
+                                if (p->done) return;
+                                if (!p->rejected)
+                                {
+                                    p->rejected = true;
+                                    p->reason = reason;
+                                }
+                                if (p->stop_on_reject)
+                                {
+                                    p->done = true;
+                                    p->npm->_reject(reason);
+                                    return;
+                                }
+                                run(p);
+                            });
+                        pm->_dep(p->npm);
+                    }
+                    p->pumping = false;
+                    if (!p->done && !p->inflight && p->cur == p->end)
+                    {
+                        p->done = true;
+                        if (p->rejected)
+                            p->npm->_reject(p->reason);
+                        else
+                            p->npm->_resolve();
+                        /* all tasks may have settled before any dependency
+                         * of npm was registered */
+                        p->npm->_trigger();
+                    }
+                }
+            };
+            if (!max_inflight) PROMISE_ERR_INVALID_QUORUM;
+            pump_t::run(std::shared_ptr<pump_t>(new pump_t{
+                std::begin(range), std::end(range),
+                std::forward<Func>(f), std::forward<Sink>(on_result),
+                max_inflight, stop_on_reject, npm,
+                0, 0, false, false, false, pm_any_t()}));
+        });
+    }
+
+    /**
+     * Same as map_limited_each(), but resolve with the results in the order
+     * of `range`.
+     */
+    template<typename Range, typename Func>
+    promise_t map_limited(const Range &range, Func &&f, size_t max_inflight,
+                        bool stop_on_reject = true) {
+        auto results = std::make_shared<values_t>();
+        return map_limited_each(range, std::forward<Func>(f), max_inflight,
+            [results](size_t idx, pm_any_t result) {
+                if (idx >= results->size()) results->resize(idx + 1);
+                (*results)[idx] = result;
+            }, stop_on_reject).then([results]() {
+                return values_t(std::move(*results));
+            });
+    }
+
     template<typename Func, disable_if_same_ref<Func, promise_t> *>
     inline promise_t::promise_t(Func &&callback):
-            pm(new Promise()),
-        ref_cnt(new size_t(1)) {
+            pm(new Promise()) {
         callback(*this);
     }
 
-    inline promise_t::promise_t():
-        pm(new Promise()),
-        ref_cnt(new size_t(1)) {}
+    inline promise_t::promise_t(): pm(new Promise()) {}
+
+    /* adopts the reference the node is created with */
+    inline promise_t::promise_t(Promise *pm): pm(pm) {}
+
+    inline promise_t::promise_t(const promise_t &other): pm(other.pm) {
+        ++pm->ref_cnt;
+    }
+
+    /** Create a promise that is already resolved with `result`, skipping the
+     * callback and triggering machinery. */
+    inline promise_t resolved(pm_any_t result) {
+        auto pm = new Promise();
+        pm->set_state(Promise::State::Fulfilled);
+        pm->value = std::move(result);
+        pm->wait_word.store(Promise::wait_fulfilled, std::memory_order_relaxed);
+        return promise_t(pm);
+    }
+
+    inline promise_t resolved() { return resolved(pm_any_t()); }
+
+    /** Create a promise that is already rejected with `reason`. */
+    inline promise_t rejected(pm_any_t reason) {
+        auto pm = new Promise();
+        pm->set_state(Promise::State::Rejected);
+        pm->value = std::move(reason);
+        pm->wait_word.store(Promise::wait_rejected, std::memory_order_relaxed);
+        return promise_t(pm);
+    }
+
+    inline promise_t rejected() { return rejected(pm_any_t()); }
 
     inline promise_t::~promise_t() {
         if (pm)
         {
-            if (--*ref_cnt) return;
+            if (--pm->ref_cnt) return;
             delete pm;
-            delete ref_cnt;
         }
     }
 
@@ -665,91 +1012,423 @@ namespace promise {
     inline void promise_t::resolve() const { (*this)->resolve(); }
     inline void promise_t::reject() const { (*this)->reject(); }
 
+    inline void promise_t::wait() const { pm->_wait(nullptr); }
+
+    template<typename Rep, typename Period>
+    inline bool promise_t::wait_for(
+            const std::chrono::duration<Rep, Period> &timeout) const {
+        auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+        return pm->_wait(&deadline) != 0;
+    }
+
+    inline pm_any_t promise_t::get() const {
+        if (pm->_wait(nullptr) == Promise::wait_rejected)
+            throw rejected_error(pm->value);
+        return pm->value;
+    }
+
     template<typename T>
-    struct callback_types {
-        using arg_type = typename function_traits<T>::arg_type;
-        using ret_type = typename std::conditional<
-            std::is_same<typename function_traits<T>::ret_type, promise_t>::value,
-            promise_t, pm_any_t>::type;
-    };
+    inline T promise_t::get() const {
+        try {
+            return any_cast<T>(get());
+        } catch (bad_any_cast &e) { PROMISE_ERR_MISMATCH_TYPE; }
+    }
 
-    template<typename Func,
-        disable_if_arg<Func, pm_any_t> * = nullptr,
-        enable_if_return<Func, void> * = nullptr,
-        typename function_traits<Func>::non_empty_arg * = nullptr>
-    constexpr auto gen_any_callback(Func &&f) {
-        using func_t = callback_types<Func>;
-        return [f = std::forward<Func>(f)](pm_any_t v) mutable {
-            try {
-                f(any_cast<typename func_t::arg_type>(v));
-            } catch (bad_any_cast &e) { PROMISE_ERR_MISMATCH_TYPE; }
-        };
+    template<typename T>
+    inline T arg_cast(const pm_any_t &v) {
+        try {
+            return any_cast<T>(v);
+        } catch (bad_any_cast &e) { PROMISE_ERR_MISMATCH_TYPE; }
     }
 
-    template<typename Func,
-        enable_if_arg<Func, pm_any_t> * = nullptr,
-        enable_if_return<Func, void> * = nullptr,
-        typename function_traits<Func>::non_empty_arg * = nullptr>
-    constexpr auto gen_any_callback(Func &&f) {
-        return [f = std::forward<Func>(f)](pm_any_t v) mutable {f(v);};
+    /* call the callback with the value converted to its argument type */
+    template<typename Arg, typename Func,
+        std::enable_if_t<std::is_void<Arg>::value> * = nullptr>
+    inline decltype(auto) step_call(Func &f, const pm_any_t &) { return f(); }
+
+    template<typename Arg, typename Func,
+        std::enable_if_t<std::is_same<std::decay_t<Arg>, pm_any_t>::value> * = nullptr>
+    inline decltype(auto) step_call(Func &f, const pm_any_t &v) { return f(v); }
+
+    template<typename Arg, typename Func,
+        std::enable_if_t<!std::is_void<Arg>::value &&
+            !std::is_same<std::decay_t<Arg>, pm_any_t>::value> * = nullptr>
+    inline decltype(auto) step_call(Func &f, const pm_any_t &v) {
+        return f(arg_cast<Arg>(v));
     }
 
-    template<typename Func,
-        enable_if_return<Func, void> * = nullptr,
-        typename function_traits<Func>::empty_arg * = nullptr>
-    constexpr auto gen_any_callback(Func &&f) { return std::forward<Func>(f); }
-
-    template<typename Func,
-        enable_if_arg<Func, pm_any_t> * = nullptr,
-        disable_if_return<Func, void> * = nullptr,
-        typename function_traits<Func>::non_empty_arg * = nullptr>
-    constexpr auto gen_any_callback(Func &&f) {
-        using func_t = callback_types<Func>;
-        return [f = std::forward<Func>(f)](pm_any_t v) mutable {
-            return typename func_t::ret_type(f(v));
-        };
+    /* hand the returned value (or promise) over to the shared settling code */
+    template<typename Ret, typename Call,
+        std::enable_if_t<std::is_void<Ret>::value> * = nullptr>
+    inline void step_settle(Call &&call, step_out_t &out) {
+        call();
+        out.settle(pm_any_t());
     }
 
-    template<typename Func,
-        disable_if_arg<Func, pm_any_t> * = nullptr,
-        disable_if_return<Func, void> * = nullptr,
-        typename function_traits<Func>::non_empty_arg * = nullptr>
-    constexpr auto gen_any_callback(Func &&f) {
-        using func_t = callback_types<Func>;
-        return [f = std::forward<Func>(f)](pm_any_t v) mutable {
-            try {
-                return typename func_t::ret_type(
-                    f(any_cast<typename func_t::arg_type>(v)));
-            } catch (bad_any_cast &e) { PROMISE_ERR_MISMATCH_TYPE; }
-        };
+    template<typename Ret, typename Call,
+        std::enable_if_t<std::is_same<Ret, promise_t>::value> * = nullptr>
+    inline void step_settle(Call &&call, step_out_t &out) {
+        out.follow(call());
     }
 
-    template<typename Func,
-        disable_if_return<Func, void> * = nullptr,
-        typename function_traits<Func>::empty_arg * = nullptr>
-    constexpr auto gen_any_callback(Func &&f) {
-        using func_t = callback_types<Func>;
-        return [f = std::forward<Func>(f)]() mutable {
-            return typename func_t::ret_type(f());
+    template<typename Ret, typename Call,
+        std::enable_if_t<!std::is_void<Ret>::value &&
+            !std::is_same<Ret, promise_t>::value> * = nullptr>
+    inline void step_settle(Call &&call, step_out_t &out) {
+        out.settle(pm_any_t(call()));
+    }
+
+    /* wrap a user callback into a step_t, all the settling and forwarding
+     * logic stays in the (non-template) Promise */
+    template<typename Func>
+    inline step_t gen_step(Func &&f) {
+        using arg_t = typename function_traits<Func>::arg_type;
+        using ret_t = typename function_traits<Func>::ret_type;
+        return [f = std::forward<Func>(f)](const pm_any_t &v, step_out_t &out) mutable {
+            step_settle<ret_t>([&]() -> ret_t { return step_call<arg_t>(f, v); }, out);
         };
     }
 
     template<typename FuncFulfilled>
     inline promise_t promise_t::then(FuncFulfilled &&on_fulfilled) const {
-        return (*this)->then(gen_any_callback(std::forward<FuncFulfilled>(on_fulfilled)));
+        return (*this)->then(gen_step(std::forward<FuncFulfilled>(on_fulfilled)));
     }
 
     template<typename FuncFulfilled, typename FuncRejected>
     inline promise_t promise_t::then(FuncFulfilled &&on_fulfilled,
                                     FuncRejected &&on_rejected) const {
-        return (*this)->then(gen_any_callback(std::forward<FuncFulfilled>(on_fulfilled)),
-                            gen_any_callback(std::forward<FuncRejected>(on_rejected)));
+        return (*this)->then(gen_step(std::forward<FuncFulfilled>(on_fulfilled)),
+                            gen_step(std::forward<FuncRejected>(on_rejected)));
     }
 
     template<typename FuncRejected>
     inline promise_t promise_t::fail(FuncRejected &&on_rejected) const {
-        return (*this)->fail(gen_any_callback(std::forward<FuncRejected>(on_rejected)));
+        return (*this)->fail(gen_step(std::forward<FuncRejected>(on_rejected)));
     }
+
+    /**
+     * Fold the results of the promises in `promise_list` into an accumulator
+     * as they arrive: `fold(acc, result)` returns the new accumulator. The
+     * results are folded in completion order, or in the order of the list if
+     * `ordered` is set (early results are held back until their turn).
+     */
+    template<typename PList, typename T, typename Fold>
+    promise_t reduce(const PList &promise_list, T init, Fold &&fold,
+                    bool ordered) {
+        return promise_t([&promise_list, &init, &fold, ordered] (promise_t &npm) {
+            using value_t = typename function_traits<Fold>::arg2_type;
+            struct fold_t {
+                T acc;
+                std::decay_t<Fold> fold;
+                bool ordered;
+                size_t left;
+                size_t next;    /* index of the next result to fold (ordered) */
+                std::unordered_map<size_t, pm_any_t> early;
+
+                void add(const pm_any_t &v) {
+                    auto f = [this](auto &&x) {
+                        acc = fold(std::move(acc), std::forward<decltype(x)>(x));
+                    };
+                    step_call<value_t>(f, v);
+                    left--;
+                }
+
+                void arrive(size_t idx, const pm_any_t &v) {
+                    if (!ordered) return add(v);
+                    if (idx != next)
+                    {
+                        early.emplace(idx, v);
+                        return;
+                    }
+                    add(v);
+                    for (auto it = early.find(++next); it != early.end();
+                            it = early.find(++next))
+                    {
+                        add(it->second);
+                        early.erase(it);
+                    }
+                }
+            };
+            auto s = std::make_shared<fold_t>(fold_t{
+                std::move(init), std::forward<Fold>(fold), ordered,
+                promise_list.size(), 0, {}});
+            if (!s->left)
+            {
+                npm->_resolve(pm_any_t(std::move(s->acc)));
+                npm->_trigger();
+                return;
+            }
+            size_t idx = 0;
+            for (const auto &pm: promise_list) {
+                pm.then(
+                    [s, idx, npm](pm_any_t result) {
+                        /* already rejected */
+                        if (!s->left) return;
+                        s->arrive(idx, result);
+                        if (!s->left)
+                            npm->_resolve(pm_any_t(std::move(s->acc)));
+                    },
+                    [s, npm](pm_any_t reason) {
+                        if (!s->left) return;
+                        s->left = 0;
+                        s->early.clear();
+                        npm->_reject(reason);
+                    });
+                pm->_dep(npm);
+                idx++;
+            }
+        });
+    }
+
+    /**
+     * Coalesce requests for the same key: the first request for a key creates
+     * the promise, later requests share the same in-flight promise. Rejected
+     * promises are evicted on settlement, fulfilled ones are retained for
+     * `ttl` (or dropped right away if `ttl` is zero). When `capacity` is
+     * non-zero, the least recently used entries are evicted beyond it.
+     * Promises handed out may outlive the cache.
+     */
+    template<typename Key,
+            typename Hash = std::hash<Key>,
+            typename Clock = std::chrono::steady_clock>
+    class cache_t {
+        using lru_t = std::list<Key>;
+        struct entry_t {
+            promise_t pm;
+            bool settled;
+            typename Clock::time_point expiry;
+            typename lru_t::iterator lru_pos;
+        };
+        using entries_t = std::unordered_map<Key, entry_t, Hash>;
+        /* a retained entry, in the order of expiry since ttl is fixed */
+        struct expiry_t {
+            typename Clock::time_point expiry;
+            Key key;
+            const Promise *pm;
+        };
+
+        /* held by the settlement callbacks only weakly */
+        struct state_t {
+            entries_t entries;
+            lru_t lru;
+            std::deque<expiry_t> expiries;
+            typename Clock::duration ttl;
+            size_t capacity;
+
+            state_t(typename Clock::duration ttl, size_t capacity):
+                ttl(ttl), capacity(capacity) {}
+
+            void erase(typename entries_t::iterator it) {
+                lru.erase(it->second.lru_pos);
+                entries.erase(it);
+            }
+
+            void on_settled(const Key &key, const Promise *pm, bool rejected) {
+                auto it = entries.find(key);
+                /* the entry may have been evicted or replaced meanwhile */
+                if (it == entries.end() || it->second.pm.operator->() != pm)
+                    return;
+                if (rejected || ttl == Clock::duration::zero())
+                    erase(it);
+                else
+                {
+                    it->second.settled = true;
+                    it->second.expiry = Clock::now() + ttl;
+                    expiries.push_back(expiry_t{it->second.expiry, key, pm});
+                }
+            }
+
+            /* drop the expired entries, so that keys requested only once do
+             * not pile up */
+            void sweep(typename Clock::time_point now) {
+                while (!expiries.empty() && !(now < expiries.front().expiry))
+                {
+                    auto it = entries.find(expiries.front().key);
+                    if (it != entries.end() &&
+                        it->second.pm.operator->() == expiries.front().pm)
+                        erase(it);
+                    expiries.pop_front();
+                }
+            }
+        };
+        std::shared_ptr<state_t> state;
+
+        public:
+        cache_t(typename Clock::duration ttl = typename Clock::duration(0),
+                size_t capacity = 0):
+            state(std::make_shared<state_t>(ttl, capacity)) {}
+
+        cache_t(const cache_t &) = delete;
+        cache_t &operator=(const cache_t &) = delete;
+
+        /** Return the promise for `key`, invoking `make()` (which returns a
+         * promise_t) only if there is no in-flight or retained one. */
+        template<typename Func>
+        promise_t get(const Key &key, Func &&make) {
+            auto &st = *state;
+            auto now = Clock::now();
+            st.sweep(now);
+            auto it = st.entries.find(key);
+            if (it != st.entries.end())
+            {
+                auto &e = it->second;
+                if (!e.settled || now < e.expiry)
+                {
+                    st.lru.splice(st.lru.begin(), st.lru, e.lru_pos);
+                    return e.pm;
+                }
+                st.erase(it);
+            }
+            promise_t pm = make();
+            st.lru.push_front(key);
+            st.entries.emplace(key, entry_t{pm, false, {}, st.lru.begin()});
+            if (st.capacity && st.entries.size() > st.capacity)
+                st.erase(st.entries.find(st.lru.back()));
+            /* may run right away if make() returned a settled promise */
+            const Promise *raw = pm.operator->();
+            std::weak_ptr<state_t> weak = state;
+            pm.then([weak, key, raw](pm_any_t) {
+                        if (auto st = weak.lock()) st->on_settled(key, raw, false);
+                    },
+                    [weak, key, raw](pm_any_t) {
+                        if (auto st = weak.lock()) st->on_settled(key, raw, true);
+                    });
+            return pm;
+        }
+
+        void erase(const Key &key) {
+            auto it = state->entries.find(key);
+            if (it != state->entries.end()) state->erase(it);
+        }
+
+        void clear() {
+            state->entries.clear();
+            state->lru.clear();
+            state->expiries.clear();
+        }
+
+        size_t size() const { return state->entries.size(); }
+    };
+
+    /**
+     * An immutable plan of then()/fail() stages, built once and run for many
+     * inputs. A run keeps its state in a single frame and only allocates
+     * more when it has to wait for a pending promise returned by a stage.
+     */
+    class pipeline_t {
+        struct stage_t {
+            step_t on_fulfilled;
+            step_t on_rejected;
+        };
+        using plan_t = std::vector<stage_t>;
+        std::shared_ptr<const plan_t> plan;
+
+        struct frame_t: public step_out_t, std::enable_shared_from_this<frame_t> {
+            std::shared_ptr<const plan_t> plan;
+            size_t next;
+            pm_any_t value;
+            bool rejected;
+            /* set while waiting for a pending promise */
+            bool suspended;
+            promise_t npm;
+
+            frame_t(std::shared_ptr<const plan_t> plan, pm_any_t input):
+                plan(std::move(plan)), next(0), value(std::move(input)),
+                rejected(false), suspended(false) {}
+
+            void settle(pm_any_t v) override { value = std::move(v); }
+
+            void follow(promise_t pm) override {
+                /* keep going right away if pm is already settled */
+                switch (pm->get_state())
+                {
+                    case Promise::State::Fulfilled:
+                    value = pm->value;
+                    rejected = false;
+                    return;
+                    case Promise::State::Rejected:
+                    value = pm->value;
+                    rejected = true;
+                    return;
+                    default:;
+                }
+                suspended = true;
+                auto self = shared_from_this();
+                pm->then([self](const pm_any_t &v, step_out_t &) {
+                    self->resume(v, false);
+                }, [self](const pm_any_t &v, step_out_t &) {
+                    self->resume(v, true);
+                });
+            }
+
+            void resume(const pm_any_t &v, bool _rejected) {
+                value = v;
+                rejected = _rejected;
+                suspended = false;
+                run();
+            }
+
+            void run() {
+                const plan_t &stages = *plan;
+                while (next < stages.size())
+                {
+                    const stage_t &stage = stages[next++];
+                    const step_t &step = rejected ? stage.on_rejected : stage.on_fulfilled;
+                    /* an empty step passes the value on as is */
+                    if (!step) continue;
+                    pm_any_t v = std::move(value);
+                    step(v, *this);
+                    if (suspended) return;
+                }
+                if (rejected)
+                    npm->_reject(std::move(value));
+                else
+                    npm->_resolve(std::move(value));
+                npm->_trigger();
+            }
+        };
+
+        pipeline_t(std::shared_ptr<const plan_t> plan): plan(std::move(plan)) {}
+
+        pipeline_t append(step_t on_fulfilled, step_t on_rejected) const {
+            auto stages = std::make_shared<plan_t>(*plan);
+            stages->push_back(stage_t{std::move(on_fulfilled), std::move(on_rejected)});
+            return pipeline_t(std::move(stages));
+        }
+
+        public:
+        pipeline_t(): plan(std::make_shared<plan_t>()) {}
+
+        /* each of the following returns a new pipeline with one more stage,
+         * taking callbacks just like the ones of promise_t */
+        template<typename FuncFulfilled>
+        pipeline_t then(FuncFulfilled &&on_fulfilled) const {
+            return append(gen_step(std::forward<FuncFulfilled>(on_fulfilled)), step_t());
+        }
+
+        template<typename FuncFulfilled, typename FuncRejected>
+        pipeline_t then(FuncFulfilled &&on_fulfilled, FuncRejected &&on_rejected) const {
+            return append(gen_step(std::forward<FuncFulfilled>(on_fulfilled)),
+                        gen_step(std::forward<FuncRejected>(on_rejected)));
+        }
+
+        template<typename FuncRejected>
+        pipeline_t fail(FuncRejected &&on_rejected) const {
+            return append(step_t(), gen_step(std::forward<FuncRejected>(on_rejected)));
+        }
+
+        /** Run the stages on `input`, returns the promise settled with the
+         * outcome of the last stage. */
+        promise_t run(pm_any_t input) const {
+            auto frame = std::make_shared<frame_t>(plan, std::move(input));
+            promise_t npm = frame->npm;
+            frame->run();
+            return npm;
+        }
+
+        size_t size() const { return plan->size(); }
+    };
 }
 
 #endif
@@ -0,0 +1,367 @@
+#ifndef _CPPROMISE_SHM_HPP
+#define _CPPROMISE_SHM_HPP
+
+/**
+ * MIT License
+ * Copyright (c) 2018 Ted Yin <tederminant@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __linux__
+#error "promise_shm.hpp requires Linux (eventfd)"
+#endif
+
+#include <new>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <typeinfo>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include "promise.hpp"
+
+#define PROMISE_ERR_SHM_SETUP do {throw std::runtime_error("failed to set up the shared memory channel");} while (0)
+#define PROMISE_ERR_SHM_MSG_SIZE do {throw std::runtime_error("value does not fit in a channel slot");} while (0)
+
+namespace promise {
+    /**
+     * Carries values of a trivially copyable type T (or no value) by copying
+     * their bytes.
+     */
+    template<typename T>
+    struct pod_serializer_t {
+        static_assert(std::is_trivially_copyable<T>::value,
+                    "pod_serializer_t needs a trivially copyable type");
+
+        static size_t serialize(const pm_any_t &value, void *buff, size_t size) {
+            if (value.type() == typeid(void)) return 0;
+            T v;
+            try {
+                v = any_cast<T>(value);
+            } catch (bad_any_cast &e) { PROMISE_ERR_MISMATCH_TYPE; }
+            if (sizeof(T) > size) PROMISE_ERR_SHM_MSG_SIZE;
+            memcpy(buff, &v, sizeof(T));
+            return sizeof(T);
+        }
+
+        static pm_any_t deserialize(const void *buff, size_t size) {
+            if (!size) return pm_any_t();
+            T v;
+            memcpy(&v, buff, sizeof(T));
+            return v;
+        }
+    };
+
+    /**
+     * Lets other processes on the same host settle the promises exported by
+     * this one. Only the creating process exports and dispatches, any number
+     * of other processes settle. A process forked after the channel is
+     * created uses its copy directly; any other process attaches with the
+     * two file descriptors from fds(), received through SCM_RIGHTS. Both
+     * are close-on-exec, so to hand them to an exec()'d program instead,
+     * clear FD_CLOEXEC on them in the child before the exec().
+     *
+     * Settlements travel through a bounded lock-free ring in shared memory.
+     * The eventfd is only written when the dispatching process is about to
+     * sleep, so a busy channel costs no system calls per message.
+     */
+    template<typename Serializer>
+    class shm_channel_t {
+        struct slot_t {
+            /* the position this slot is ready for: pos when free, pos + 1
+             * once filled */
+            std::atomic<uint64_t> seq;
+            uint64_t id;
+            uint32_t rejected;
+            uint32_t size;
+            /* followed by the payload */
+        };
+
+        struct ring_t {
+            /* the geometry, for the attaching processes */
+            uint64_t capacity;
+            uint64_t payload_size;
+            alignas(64) std::atomic<uint64_t> tail;
+            alignas(64) std::atomic<uint32_t> sleeping;
+            /* followed by the slots */
+        };
+
+        static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+                    "shared memory atomics must be lock-free");
+
+        ring_t *ring;
+        size_t map_size;
+        size_t slot_stride;
+        size_t payload_size;
+        uint64_t mask;
+        int rfd;
+        int efd;
+        /* consumer side */
+        uint64_t head;
+        uint64_t next_id;
+        std::unordered_map<uint64_t, promise_t> exported;
+
+        slot_t *slot(uint64_t pos) const {
+            return reinterpret_cast<slot_t *>(
+                reinterpret_cast<char *>(ring) + sizeof(ring_t) +
+                (pos & mask) * slot_stride);
+        }
+
+        static unsigned char *payload(slot_t *s) {
+            return reinterpret_cast<unsigned char *>(s + 1);
+        }
+
+        void post(uint64_t id, const pm_any_t &value, bool rejected) {
+            uint64_t pos = ring->tail.load(std::memory_order_relaxed);
+            slot_t *s;
+            for (;;)
+            {
+                s = slot(pos);
+                int64_t diff = int64_t(s->seq.load(std::memory_order_acquire) - pos);
+                if (diff == 0)
+                {
+                    if (ring->tail.compare_exchange_weak(pos, pos + 1,
+                            std::memory_order_relaxed))
+                        break;
+                }
+                else if (diff < 0)
+                {
+                    /* full, the consumer is awake since it only sleeps on an
+                     * empty ring */
+                    sched_yield();
+                    pos = ring->tail.load(std::memory_order_relaxed);
+                }
+                else
+                    pos = ring->tail.load(std::memory_order_relaxed);
+            }
+            s->id = id;
+            s->rejected = rejected;
+            try {
+                s->size = uint32_t(Serializer::serialize(value, payload(s), payload_size));
+            } catch (...) {
+                /* the slot is claimed and has to be published anyway, so
+                 * the promise is rejected without a reason */
+                s->rejected = 1;
+                s->size = 0;
+                s->seq.store(pos + 1, std::memory_order_release);
+                wake();
+                throw;
+            }
+            s->seq.store(pos + 1, std::memory_order_release);
+            wake();
+        }
+
+        void wake() {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ring->sleeping.load(std::memory_order_relaxed) &&
+                ring->sleeping.exchange(0, std::memory_order_relaxed))
+            {
+                uint64_t one = 1;
+                while (write(efd, &one, sizeof(one)) < 0 && errno == EINTR);
+            }
+        }
+
+        bool pending() const {
+            return slot(head)->seq.load(std::memory_order_acquire) == head + 1;
+        }
+
+        void set_geometry(uint64_t capacity) {
+            mask = capacity - 1;
+            slot_stride = (sizeof(slot_t) + payload_size + alignof(slot_t) - 1) &
+                            ~(alignof(slot_t) - 1);
+            map_size = sizeof(ring_t) + capacity * slot_stride;
+        }
+
+        void map() {
+            void *mem = mmap(nullptr, map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, rfd, 0);
+            if (mem == MAP_FAILED)
+            {
+                close(rfd);
+                close(efd);
+                PROMISE_ERR_SHM_SETUP;
+            }
+            ring = static_cast<ring_t *>(mem);
+        }
+
+        public:
+        /* the descriptors another process needs to attach */
+        struct fds_t {
+            int ring_fd;
+            int event_fd;
+        };
+
+        /* the capacity is rounded up to a power of two, payload_size bounds
+         * the serialized size of a value */
+        shm_channel_t(size_t capacity = 1024, size_t payload_size = 64):
+                payload_size(payload_size), head(0), next_id(0) {
+            size_t cap = 1;
+            while (cap < capacity) cap <<= 1;
+            set_geometry(cap);
+            rfd = memfd_create("promise_shm", MFD_CLOEXEC);
+            if (rfd < 0) PROMISE_ERR_SHM_SETUP;
+            efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (efd < 0 || ftruncate(rfd, off_t(map_size)) < 0)
+            {
+                close(rfd);
+                if (efd >= 0) close(efd);
+                PROMISE_ERR_SHM_SETUP;
+            }
+            map();
+            new (ring) ring_t();
+            ring->capacity = cap;
+            ring->payload_size = payload_size;
+            ring->tail.store(0, std::memory_order_relaxed);
+            ring->sleeping.store(0, std::memory_order_relaxed);
+            for (uint64_t i = 0; i < cap; i++)
+                new (slot(i)) slot_t{{i}, 0, 0, 0};
+        }
+
+        /** Attach to the channel of another process to settle its promises,
+         * taking over the descriptors. */
+        explicit shm_channel_t(fds_t fds):
+                rfd(fds.ring_fd), efd(fds.event_fd), head(0), next_id(0) {
+            /* capacity and payload_size lead the ring */
+            uint64_t geometry[2];
+            if (pread(rfd, geometry, sizeof(geometry), 0) != ssize_t(sizeof(geometry)))
+            {
+                close(rfd);
+                close(efd);
+                PROMISE_ERR_SHM_SETUP;
+            }
+            payload_size = geometry[1];
+            set_geometry(geometry[0]);
+            map();
+        }
+
+        shm_channel_t(const shm_channel_t &) = delete;
+        shm_channel_t &operator=(const shm_channel_t &) = delete;
+
+        ~shm_channel_t() {
+            munmap(ring, map_size);
+            close(rfd);
+            close(efd);
+        }
+
+        fds_t fds() const { return fds_t{rfd, efd}; }
+
+        /** Register `pm` to be settled remotely, returns the id to pass to
+         * the settling process. */
+        uint64_t export_promise(const promise_t &pm) {
+            uint64_t id = next_id++;
+            exported.emplace(id, pm);
+            return id;
+        }
+
+        /** Settle the exported promise `id` from any process. */
+        void resolve(uint64_t id, const pm_any_t &result = pm_any_t()) {
+            post(id, result, false);
+        }
+
+        void reject(uint64_t id, const pm_any_t &reason = pm_any_t()) {
+            post(id, reason, true);
+        }
+
+        /** Settle the promises for all arrived messages without blocking,
+         * returns the number of messages handled. */
+        size_t dispatch() {
+            size_t n = 0;
+            /* awake now, spare the senders the wakeups */
+            if (ring->sleeping.load(std::memory_order_relaxed))
+                ring->sleeping.store(0, std::memory_order_relaxed);
+            while (pending())
+            {
+                slot_t *s = slot(head);
+                auto it = exported.find(s->id);
+                if (it != exported.end())
+                {
+                    promise_t pm = std::move(it->second);
+                    exported.erase(it);
+                    pm_any_t value = Serializer::deserialize(payload(s), s->size);
+                    bool rejected = s->rejected;
+                    /* free the slot before running the callbacks */
+                    s->seq.store(head + mask + 1, std::memory_order_release);
+                    head++;
+                    if (rejected)
+                        pm.reject(std::move(value));
+                    else
+                        pm.resolve(std::move(value));
+                }
+                else
+                {
+                    s->seq.store(head + mask + 1, std::memory_order_release);
+                    head++;
+                }
+                n++;
+            }
+            return n;
+        }
+
+        /** Ask for a wakeup through fd(), returns false if messages have
+         * already arrived and dispatch() should be called instead. */
+        bool arm() {
+            /* consume the earlier wakeups so that fd() polls readable only
+             * for new ones */
+            uint64_t cnt;
+            while (read(efd, &cnt, sizeof(cnt)) < 0 && errno == EINTR);
+            ring->sleeping.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!pending()) return true;
+            ring->sleeping.store(0, std::memory_order_relaxed);
+            return false;
+        }
+
+        /** The eventfd to poll for when integrating with an event loop, see
+         * arm(). */
+        int fd() const { return efd; }
+
+        /** Block until at least one message is dispatched, or until `timeout_ms`
+         * passes (-1 waits indefinitely), returns the number handled. */
+        size_t wait(int timeout_ms = -1) {
+            using namespace std::chrono;
+            auto deadline = steady_clock::now() + milliseconds(timeout_ms);
+            size_t n;
+            while (!(n = dispatch()))
+            {
+                /* give the senders a chance before paying for a sleep */
+                for (int i = 0; i < 16 && !pending(); i++) sched_yield();
+                if (pending() || !arm()) continue;
+                int remaining = -1;
+                if (timeout_ms >= 0)
+                {
+                    auto left = duration_cast<milliseconds>(
+                        deadline - steady_clock::now()).count();
+                    remaining = left > 0 ? int(left) : 0;
+                }
+                struct pollfd pfd = {efd, POLLIN, 0};
+                if (poll(&pfd, 1, remaining) == 0) return dispatch();
+            }
+            return n;
+        }
+
+        /* the number of exported promises not settled yet */
+        size_t size() const { return exported.size(); }
+    };
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include <string>
+#include <thread>
 #include <functional>
 #include "promise.hpp"
 
@@ -45,6 +46,361 @@ void test_fac() {
     root.resolve(std::make_pair(1, 1));
 }
 
+void test_settled() {
+    promise::resolved(1).then([](int x) {
+        printf("resolved() passed on %d\n", x);
+    });
+    promise::resolved().then([]() {
+        puts("resolved() without a value");
+    });
+    promise::rejected(-1).then([]() {
+        puts("this line should not appear in the output");
+    }).fail([](int reason) {
+        printf("rejected() passed on %d\n", reason);
+    });
+    promise::rejected().fail([]() {
+        puts("rejected() without a reason");
+    });
+    /* a callback returning a settled promise is followed right away */
+    promise_t root;
+    root.then([](int x) {
+        return promise::resolved(x + 1);
+    }).then([](int x) {
+        printf("followed resolved() with %d\n", x);
+        return promise::rejected(x + 1);
+    }).fail([](int reason) {
+        printf("followed rejected() with %d\n", reason);
+    });
+    root.resolve(1);
+}
+
+void test_some() {
+    std::vector<promise_t> replicas(3);
+    promise::some(2, replicas).then([](const promise::values_t values) {
+        printf("quorum reached with %d, %d\n",
+                any_cast<int>(values[0]),
+                any_cast<int>(values[1]));
+    });
+    replicas[1].reject(-1);
+    replicas[2].resolve(3);
+    replicas[0].resolve(1);
+
+    std::vector<promise_t> flaky(3);
+    promise::some(2, flaky).then([]() {
+        puts("this line should not appear in the outputs");
+    }, [](int reason) {
+        printf("quorum unreachable: %d\n", reason);
+    });
+    flaky[0].reject(-2);
+    flaky[2].reject(-3);
+    flaky[1].resolve(2);
+}
+
+void test_hedge() {
+    std::vector<promise_t> attempts;
+    promise_t timer;
+    auto attempt = [&attempts]() {
+        printf("hedge attempt %d started\n", (int)attempts.size());
+        attempts.push_back(promise_t());
+        return attempts.back();
+    };
+    promise::hedge(attempt, [&timer]() {return timer;})
+        .then([](int x) {
+            printf("hedged request got %d\n", x);
+        });
+    timer.resolve();
+    attempts[1].resolve(2);
+    attempts[0].resolve(1);
+}
+
+void test_cache() {
+    promise::cache_t<std::string> cache(std::chrono::hours(1), 2);
+    std::vector<promise_t> backend;
+    auto fetch = [&cache, &backend](std::string key) {
+        return cache.get(key, [&backend, key]() {
+            printf("backend fetch for %s\n", key.c_str());
+            backend.push_back(promise_t());
+            return backend.back();
+        });
+    };
+    auto print = [](std::string key) {
+        return [key](int x) {printf("%s = %d\n", key.c_str(), x);};
+    };
+    fetch("a").then(print("a"));
+    fetch("a").then(print("a"));
+    backend[0].resolve(1);
+    fetch("a").then(print("a"));
+    fetch("b").fail([](int reason) {printf("b failed: %d\n", reason);});
+    backend[1].reject(-1);
+    fetch("b").then(print("b"));
+    fetch("c").then(print("c"));
+    backend[2].resolve(2);
+    backend[3].resolve(3);
+    printf("cache holds %d entries\n", (int)cache.size());
+    fetch("a").then(print("a"));
+    backend[4].resolve(4);
+}
+
+/* a clock advanced by hand for the TTL tests */
+struct manual_clock_t {
+    using duration = std::chrono::milliseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point<manual_clock_t>;
+    static const bool is_steady = true;
+    static rep ticks;
+    static time_point now() { return time_point(duration(ticks)); }
+};
+
+manual_clock_t::rep manual_clock_t::ticks = 0;
+
+void test_cache_lifetime() {
+    /* expired entries are swept even if their keys never come back */
+    promise::cache_t<int, std::hash<int>, manual_clock_t> cache(
+        std::chrono::milliseconds(10));
+    for (int i = 0; i < 100; i++)
+        cache.get(i, [i]() { return promise::resolved(i); });
+    printf("cache holds %d entries\n", (int)cache.size());
+    manual_clock_t::ticks += 20;
+    cache.get(-1, []() { return promise_t(); });
+    printf("cache holds %d entries after expiry\n", (int)cache.size());
+
+    /* a promise handed out may be settled after the cache is gone */
+    promise_t pending;
+    {
+        promise::cache_t<int> short_lived;
+        short_lived.get(0, [&pending]() { return pending; });
+    }
+    pending.then([](int x) { printf("settled %d after the cache was gone\n", x); });
+    pending.resolve(5);
+}
+
+void test_map_limited() {
+    std::vector<int> inputs{1, 2, 3, 4, 5};
+    std::vector<promise_t> tasks;
+    auto launch = [&tasks](int x) {
+        printf("task %d launched\n", x);
+        tasks.push_back(promise_t());
+        return tasks.back();
+    };
+    promise::map_limited(inputs, launch, 2).then([](const promise::values_t values) {
+        for (const auto &v: values)
+            printf("mapped result %d\n", any_cast<int>(v));
+    });
+    /* each settled task lets exactly one more in */
+    printf("%zu tasks launched\n", tasks.size());
+    tasks[1].resolve(20);
+    printf("%zu tasks launched\n", tasks.size());
+    tasks[0].resolve(10);
+    printf("%zu tasks launched\n", tasks.size());
+    tasks[3].resolve(40);
+    printf("%zu tasks launched\n", tasks.size());
+    tasks[2].resolve(30);
+    tasks[4].resolve(50);
+
+    /* the first rejection stops launching and rejects right away */
+    tasks.clear();
+    promise::map_limited(inputs, launch, 2).then([](const promise::values_t) {
+        puts("map with stop_on_reject resolved");
+    }, [](int reason) {
+        printf("map with stop_on_reject rejected with %d\n", reason);
+    });
+    tasks[1].reject(-2);
+    tasks[0].resolve(10);
+    printf("%zu tasks launched\n", tasks.size());
+
+    /* without stop_on_reject, the remaining tasks still run */
+    tasks.clear();
+    promise::map_limited(inputs, launch, 2, false).then([](const promise::values_t) {
+        puts("map without stop_on_reject resolved");
+    }, [](int reason) {
+        printf("map without stop_on_reject rejected with %d\n", reason);
+    });
+    tasks[0].reject(-1);
+    tasks[1].resolve(20);
+    tasks[2].reject(-3);
+    tasks[3].resolve(40);
+    tasks[4].resolve(50);
+    printf("%zu tasks launched\n", tasks.size());
+
+    /* results are streamed in completion order */
+    tasks.clear();
+    promise::map_limited_each(inputs, launch, 3, [](size_t idx, promise::pm_any_t result) {
+        printf("result of task %zu: %d\n", idx + 1, any_cast<int>(result));
+    }).then([]() {
+        puts("all results streamed");
+    });
+    tasks[2].resolve(30);
+    tasks[0].resolve(10);
+    tasks[4].resolve(50);
+    tasks[1].resolve(20);
+    tasks[3].resolve(40);
+}
+
+void test_wait() {
+    promise_t pm;
+    std::thread worker([pm]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        pm.resolve(42);
+    });
+    if (!pm.wait_for(std::chrono::milliseconds(1)))
+        puts("wait timed out");
+    printf("get returned %d\n", pm.get<int>());
+    worker.join();
+    try {
+        promise::rejected(-1).get();
+    } catch (promise::rejected_error &e) {
+        printf("get threw %d\n", any_cast<int>(e.reason));
+    }
+}
+
+#ifdef CPPROMISE_USE_ATOMIC_REFCNT
+/* handles to the same promise copied and dropped on several threads */
+void test_wait_shared() {
+    std::vector<std::thread> workers;
+    std::atomic<int> sum(0);
+    {
+        promise_t pm;
+        for (int i = 0; i < 4; i++)
+            workers.emplace_back([pm, &sum]() {
+                for (int j = 0; j < 100000; j++)
+                    promise_t copy(pm);
+                sum += pm.get<int>();
+            });
+        for (int j = 0; j < 100000; j++)
+            promise_t copy(pm);
+        pm.resolve(7);
+        /* the workers may outlive this handle */
+    }
+    for (auto &w: workers) w.join();
+    printf("shared waiters got %d in total\n", sum.load());
+}
+#endif
+
+void test_reduce() {
+    std::vector<promise_t> parts(4);
+    promise::reduce(parts, 0, [](int acc, int x) {
+        printf("folding %d\n", x);
+        return acc + x;
+    }).then([](int sum) {
+        printf("sum = %d\n", sum);
+    });
+    promise::reduce(parts, std::string(), [](std::string acc, int x) {
+        return acc + std::to_string(x);
+    }, true).then([](std::string s) {
+        printf("ordered fold = %s\n", s.c_str());
+    });
+    parts[2].resolve(3);
+    parts[0].resolve(1);
+    parts[3].resolve(4);
+    parts[1].resolve(2);
+}
+
+void test_pipeline() {
+    auto fac = promise::pipeline_t();
+    for (int i = 0; i < 5; i++)
+        fac = fac.then([](std::pair<int, int> p) {
+            p.first *= p.second;
+            p.second++;
+            return p;
+        });
+    for (int n = 1; n <= 3; n++)
+        fac.run(std::make_pair(1, n + 1)).then([n](std::pair<int, int> p) {
+            printf("fac(%d) / fac(%d) = %d\n", p.second - 1, n, p.first);
+        });
+
+    std::vector<promise_t> lookups;
+    auto handler = promise::pipeline_t()
+        .then([&lookups](int key) {
+            printf("looking up %d\n", key);
+            lookups.emplace_back();
+            return lookups.back();
+        })
+        .then([](int value) {
+            if (value < 0) return promise::rejected(value);
+            return promise::resolved(value * 10);
+        })
+        .fail([](int reason) {
+            printf("lookup failed: %d\n", reason);
+        })
+        .then([](int value) {
+            printf("handled %d\n", value);
+        });
+    handler.run(1);
+    handler.run(2);
+    lookups[1].resolve(-2);
+    lookups[0].resolve(1);
+}
+
+#if defined(CPPROMISE_USE_STACK_FREE) || defined(CPPROMISE_USE_HYBRID)
+/* chains deeper than the recursive mode (or the hybrid depth budget) can take */
+void test_deep() {
+    const int depth = 4 * CPPROMISE_HYBRID_DEPTH;
+    promise_t root;
+    promise_t t = root;
+    for (int i = 0; i < depth; i++)
+        t = t.then([](std::pair<int, int> p) {
+            p.first = (p.first * p.second) % 10007;
+            p.second++;
+            return p;
+        });
+    t.then([depth](std::pair<int, int> p) {
+        printf("deep fac(%d) mod 10007 = %d\n", depth, p.first);
+    });
+    root.resolve(std::make_pair(1, 1));
+
+    /* a rejection raised past the depth budget reaches the end of the chain */
+    promise_t root2;
+    t = root2;
+    for (int i = 0; i < depth; i++)
+        t = t.then([i, depth](int x) {
+            if (i == depth / 2) return promise::rejected(-x);
+            return promise::resolved(x + 1);
+        });
+    t.then([](int) {
+        puts("deep rejection was lost");
+    }, [](int reason) {
+        printf("deep rejection reached the tail: %d\n", reason);
+    });
+    root2.resolve(0);
+
+    /* stages returning settled promises must not nest traversals */
+    promise_t root3;
+    t = root3;
+    for (int i = 0; i < 1000000; i++)
+        t = t.then([](int x) { return promise::resolved(x + 1); });
+    t.then([](int x) {
+        printf("deep chain of resolved() ended with %d\n", x);
+    });
+    root3.resolve(0);
+
+    /* a then() registered on a promise settled around the depth budget still
+     * runs after the ones registered before */
+    bool ordered = true;
+    for (int len = CPPROMISE_HYBRID_DEPTH - 3; len <= CPPROMISE_HYBRID_DEPTH + 3; len++)
+    {
+        std::string order;
+        promise_t p;
+        p.then([&order]() { order += "A"; });
+        promise_t head;
+        t = head;
+        for (int i = 0; i < len; i++)
+            t = t.then([]() {});
+        t.then([&order, p]() {
+            p.resolve();
+            p.then([&order]() { order += "B"; });
+        });
+        head.resolve();
+        if (order != "AB")
+        {
+            printf("then() order broken at length %d: %s\n", len, order.c_str());
+            ordered = false;
+        }
+    }
+    if (ordered) puts("then() order kept across the depth budget");
+}
+#endif
+
 int main() {
     callback_t t1;
     callback_t t2;
@@ -159,4 +515,19 @@ int main() {
     puts("calling t2: resolve the second half of promise 1 (promise 2)");
     t2();
     test_fac();
+    test_settled();
+    test_some();
+    test_hedge();
+    test_cache();
+    test_cache_lifetime();
+    test_map_limited();
+    test_wait();
+    test_reduce();
+    test_pipeline();
+#if defined(CPPROMISE_USE_STACK_FREE) || defined(CPPROMISE_USE_HYBRID)
+    test_deep();
+#endif
+#ifdef CPPROMISE_USE_ATOMIC_REFCNT
+    test_wait_shared();
+#endif
 }
@@ -0,0 +1,224 @@
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "promise_shm.hpp"
+
+using promise::promise_t;
+
+/* carries a std::string as its length-free bytes */
+struct string_serializer_t {
+    static size_t serialize(const promise::pm_any_t &value, void *buff, size_t size) {
+        auto s = promise::any_cast<std::string>(value);
+        if (s.size() > size) PROMISE_ERR_SHM_MSG_SIZE;
+        memcpy(buff, s.data(), s.size());
+        return s.size();
+    }
+
+    static promise::pm_any_t deserialize(const void *buff, size_t size) {
+        return std::string(static_cast<const char *>(buff), size);
+    }
+};
+
+template<typename Func>
+pid_t spawn(Func f) {
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        f();
+        _exit(0);
+    }
+    return pid;
+}
+
+void test_shm_basic() {
+    puts("=== shm basic ===");
+    promise::shm_channel_t<promise::pod_serializer_t<int>> ch;
+    promise_t pms[3];
+    int results[3] = {0, 0, 0};
+    uint64_t ids[3];
+    for (int i = 0; i < 3; i++)
+    {
+        ids[i] = ch.export_promise(pms[i]);
+        pms[i].then([&results, i](int x) {
+            results[i] = x;
+        }, [&results, i](int x) {
+            results[i] = -1000 + x;
+        });
+    }
+    pid_t w1 = spawn([&]() {
+        ch.resolve(ids[0], 42);
+        ch.reject(ids[1], 1);
+    });
+    pid_t w2 = spawn([&]() { ch.resolve(ids[2], 7); });
+    while (ch.size()) ch.wait();
+    waitpid(w1, nullptr, 0);
+    waitpid(w2, nullptr, 0);
+    for (int i = 0; i < 3; i++)
+        printf("promise %d settled with %d\n", i, results[i]);
+}
+
+void test_shm_load() {
+    puts("=== shm load ===");
+    const int nworkers = 4, nmsgs = 20000;
+    /* a small ring so that the senders have to wait for space */
+    promise::shm_channel_t<promise::pod_serializer_t<long>> ch(64);
+    std::vector<promise_t> pms(nworkers * nmsgs);
+    std::vector<uint64_t> ids;
+    long sum = 0;
+    for (auto &pm: pms)
+    {
+        ids.push_back(ch.export_promise(pm));
+        pm.then([&sum](long x) { sum += x; });
+    }
+    std::vector<pid_t> workers;
+    for (int w = 0; w < nworkers; w++)
+        workers.push_back(spawn([&, w]() {
+            for (int i = w; i < nworkers * nmsgs; i += nworkers)
+                ch.resolve(ids[i], long(i));
+        }));
+    while (ch.size()) ch.wait();
+    for (auto pid: workers) waitpid(pid, nullptr, 0);
+    long n = nworkers * nmsgs;
+    printf("settled %ld promises, sum = %ld (expected %ld)\n",
+            n, sum, n * (n - 1) / 2);
+}
+
+void test_shm_serializer() {
+    puts("=== shm serializer ===");
+    promise::shm_channel_t<string_serializer_t> ch(16, 32);
+    promise_t pm1, pm2;
+    auto id1 = ch.export_promise(pm1);
+    auto id2 = ch.export_promise(pm2);
+    /* a single sender, so the messages arrive in order */
+    pm1.then([](std::string s) {
+        printf("got \"%s\"\n", s.c_str());
+    }, []() {
+        puts("oversized value rejected");
+    });
+    pm2.then([](std::string s) {
+        printf("got \"%s\"\n", s.c_str());
+    });
+    pid_t w = spawn([&]() {
+        try {
+            ch.resolve(id1, std::string(64, 'x'));
+        } catch (std::runtime_error &e) {
+            /* the receiver sees a rejection instead */
+        }
+        ch.resolve(id2, std::string("from another process"));
+    });
+    while (ch.size()) ch.wait();
+    waitpid(w, nullptr, 0);
+}
+
+void test_shm_event_loop() {
+    puts("=== shm event loop ===");
+    promise::shm_channel_t<promise::pod_serializer_t<int>> ch;
+    promise_t pms[2];
+    uint64_t ids[2];
+    for (int i = 0; i < 2; i++)
+    {
+        ids[i] = ch.export_promise(pms[i]);
+        pms[i].then([i](int x) { printf("promise %d settled with %d\n", i, x); });
+    }
+    int go[2];
+    if (pipe(go) < 0) return;
+    pid_t w = spawn([&]() {
+        ch.resolve(ids[0], 1);
+        /* hold the second message until the receiver has idled */
+        char c;
+        if (read(go[0], &c, 1) == 1) ch.resolve(ids[1], 2);
+    });
+    struct pollfd pfd = {ch.fd(), POLLIN, 0};
+    auto loop_once = [&](int timeout_ms) {
+        if (!ch.arm()) return ch.dispatch();
+        int ret = poll(&pfd, 1, timeout_ms);
+        size_t n = ch.dispatch();
+        if (!n) printf("poll returned %d, nothing dispatched\n", ret);
+        return n;
+    };
+    while (!loop_once(-1));
+    /* nothing else is coming, so the armed fd must not report readable */
+    loop_once(200);
+    if (write(go[1], "x", 1) != 1) return;
+    while (!loop_once(-1));
+    waitpid(w, nullptr, 0);
+    close(go[0]);
+    close(go[1]);
+    auto start = std::chrono::steady_clock::now();
+    size_t n = ch.wait(100);
+    printf("idle wait(100) dispatched %zu, %s\n", n,
+            std::chrono::steady_clock::now() - start < std::chrono::seconds(1) ?
+                "in time" : "too late");
+}
+
+void send_fds(int sock, promise::shm_channel_t<promise::pod_serializer_t<int>>::fds_t fds) {
+    int fd_list[2] = {fds.ring_fd, fds.event_fd};
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    char buff[CMSG_SPACE(sizeof(fd_list))];
+    memset(buff, 0, sizeof(buff));
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buff;
+    msg.msg_controllen = sizeof(buff);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fd_list));
+    memcpy(CMSG_DATA(cmsg), fd_list, sizeof(fd_list));
+    if (sendmsg(sock, &msg, 0) < 0) perror("sendmsg");
+}
+
+promise::shm_channel_t<promise::pod_serializer_t<int>>::fds_t recv_fds(int sock) {
+    int fd_list[2] = {-1, -1};
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char buff[CMSG_SPACE(sizeof(fd_list))];
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buff;
+    msg.msg_controllen = sizeof(buff);
+    if (recvmsg(sock, &msg, 0) > 0)
+        memcpy(fd_list, CMSG_DATA(CMSG_FIRSTHDR(&msg)), sizeof(fd_list));
+    return {fd_list[0], fd_list[1]};
+}
+
+void test_shm_attach() {
+    puts("=== shm attach ===");
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0) return;
+    /* the settling process starts before the channel exists, so it can only
+     * reach it through the descriptors */
+    pid_t w = spawn([&]() {
+        close(socks[0]);
+        auto fds = recv_fds(socks[1]);
+        uint64_t id;
+        if (read(socks[1], &id, sizeof(id)) != sizeof(id)) return;
+        promise::shm_channel_t<promise::pod_serializer_t<int>> remote(fds);
+        remote.resolve(id, 99);
+    });
+    close(socks[1]);
+    promise::shm_channel_t<promise::pod_serializer_t<int>> ch(8, 16);
+    promise_t pm;
+    uint64_t id = ch.export_promise(pm);
+    pm.then([](int x) { printf("attached process settled with %d\n", x); });
+    send_fds(socks[0], ch.fds());
+    if (write(socks[0], &id, sizeof(id)) != sizeof(id)) return;
+    while (ch.size()) ch.wait();
+    waitpid(w, nullptr, 0);
+    close(socks[0]);
+}
+
+int main() {
+    test_shm_basic();
+    test_shm_load();
+    test_shm_serializer();
+    test_shm_event_loop();
+    test_shm_attach();
+    return 0;
+}